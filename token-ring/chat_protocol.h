@@ -15,12 +15,25 @@
 #define TRANSPORT_TCP   1
 #define TRANSPORT_UDP   2
 
-#define TOKEN_SLEEP_TIME 1000000   // sleep time in miliseconds after receiving the token
+#define TOKEN_SLEEP_TIME 1000000   // default sleep time in microseconds after receiving the token
 
 #define MAX_TCP_REQUESTS 5
 
 #define MAX_MSG_SIZE 127
 
+// load generator settings
+#define LOAD_MSG_PREFIX         "#LOAD"     // marks generated messages, followed by sequence number and send time
+#define LOAD_HEADER_SIZE        34          // prefix, 10-digit sequence number, 16-digit send time and separators
+#define LOAD_REPORT_PERIOD      10          // seconds between latency reports
+#define LOAD_MAX_QUEUE_DEPTH    1000        // generated messages are dropped when this many are queued
+#define LOAD_SUB_BUCKETS_BITS   4           // latency histogram precision (16 linear sub-buckets per power of 2)
+#define LOAD_HISTOGRAM_SIZE     1024
+
+// load payload size distributions
+#define LOAD_SIZE_FIXED         1
+#define LOAD_SIZE_UNIFORM       2
+#define LOAD_SIZE_EXPONENTIAL   3
+
 struct data_message {
     char type;
     char token_is_free;
@@ -39,6 +52,8 @@ struct connection_message {
     sockaddr_in neighbour_address;
 };
 
+void error_exit(const char* message);
+
 void deserialize_data_msg(const char* buffer, int len, struct data_message* msg);
 
 void deserialize_connection_msg(const char* buffer, struct connection_message* msg);
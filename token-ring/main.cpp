@@ -8,8 +8,14 @@
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
 
 #include <unistd.h>
+#include <signal.h>
 
 #include <sys/socket.h>
 
@@ -17,6 +23,7 @@
 #include <arpa/inet.h>
 
 #include "chat_protocol.h"
+#include "trace.h"
 
 
 bool operator==(const struct sockaddr_in &a, const struct sockaddr_in &b) {
@@ -83,11 +90,13 @@ struct sockaddr_in get_neighbour_address() {
 
 // text messages queue
 std::queue<struct data_message> message_queue;
+std::atomic<int> message_queue_depth(0);    // readable without locking, for tracing
 std::mutex mt_message_queue;
 
 void push_data_message(struct data_message msg) {
     std::lock_guard<std::mutex> lock(mt_message_queue);
     message_queue.push(msg);
+    message_queue_depth.store(message_queue.size(), std::memory_order_relaxed);
 }
 
 int pop_data_message(struct data_message* msg) {
@@ -97,11 +106,22 @@ int pop_data_message(struct data_message* msg) {
 
     memcpy(msg, &message_queue.front(), sizeof(struct data_message));
     message_queue.pop();
+    message_queue_depth.store(message_queue.size(), std::memory_order_relaxed);
     return 0;
 }
 
 
 
+// frame trace capture (disabled unless trace file is given)
+Trace* trace = NULL;
+
+void trace_frame(char direction, const char* frame, int size, const struct sockaddr_in* peer) {
+    if (trace != NULL)
+        trace->record(direction, frame, size, peer, message_queue_depth.load(std::memory_order_relaxed));
+}
+
+
+
 // connection requests queue
 std::set<std::pair<in_port_t, in_addr_t> > pending_requests;
 std::mutex mt_pending_requests;
@@ -138,6 +158,7 @@ int get_pending_request(struct sockaddr_in* request) {
 
 // token parameters
 bool has_starting_token;
+int token_hold_time = TOKEN_SLEEP_TIME;     // in microseconds, may be changed with --hold
 bool token_is_free;
 std::mutex mt_token;
 
@@ -150,6 +171,223 @@ bool get_starting_token() {
 
 
 
+// load generator parameters
+bool load_mode = false;
+std::vector<std::string> load_destinations;
+double load_rate;               // messages per second
+bool load_poisson;              // poisson arrivals if set, fixed interval otherwise
+char load_size_distribution;    // one of LOAD_SIZE_* (sizes include LOAD_HEADER_SIZE bytes of header)
+int load_min_size;
+int load_max_size;
+std::atomic<unsigned long> load_generated(0);
+std::atomic<unsigned long> load_dropped(0);    // messages not enqueued because the queue was full
+
+/**
+ * Builds data message with given receiver and text (same layout as messages typed by the user).
+ * Returns -1 if the message does not fit into the buffer.
+ */
+int make_data_message(const char* receiver, const char* text, struct data_message* msg) {
+    int sender_len = strlen(username);
+    int receiver_len = strlen(receiver);
+    int text_len = strlen(text);
+
+    if (2 + sender_len + 1 + receiver_len + 1 + text_len + 1 > MAX_MSG_SIZE)
+        return -1;
+
+    msg->type = MSG_DATA;
+    msg->token_is_free = 0;
+    msg->buffer[0] = MSG_DATA;
+    msg->buffer[1] = 0;
+
+    msg->sender_index = 2;
+    strcpy(&msg->buffer[msg->sender_index], username);
+
+    msg->receiver_index = msg->sender_index + sender_len + 1;
+    strcpy(&msg->buffer[msg->receiver_index], receiver);
+
+    msg->data_index = msg->receiver_index + receiver_len + 1;
+    strcpy(&msg->buffer[msg->data_index], text);
+
+    msg->total_length = msg->data_index + text_len + 1;
+    return 0;
+}
+
+// returns the largest payload that fits into a message from this process to given receiver
+int max_load_payload_size(const char* receiver) {
+    return MAX_MSG_SIZE - 2 - (strlen(username) + 1) - (strlen(receiver) + 1) - 1;
+}
+
+/**
+ * Builds load message with payload of given size. The payload starts with fixed width header
+ * (LOAD_MSG_PREFIX, sequence number and intended send time in microseconds since epoch),
+ * the rest is padding. Returns -1 if the payload does not fit into the message.
+ */
+int make_load_message(const char* receiver, unsigned long seq, long long send_time_us, int size,
+        struct data_message* msg) {
+
+    char payload[MAX_MSG_SIZE];
+    if (size < LOAD_HEADER_SIZE || size > max_load_payload_size(receiver))
+        return -1;
+
+    snprintf(payload, sizeof(payload), "%s %010lu %016lld ", LOAD_MSG_PREFIX, seq % 10000000000ul, send_time_us);
+
+    for (int i = LOAD_HEADER_SIZE; i < size; i++)
+        payload[i] = 'x';
+
+    payload[size] = '\0';
+    return make_data_message(receiver, payload, msg);
+}
+
+long long current_time_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+
+// one-way latency statistics of received load messages (log-linear histogram in microseconds)
+unsigned long latency_histogram[LOAD_HISTOGRAM_SIZE];
+unsigned long latency_samples;
+long long latency_max;
+unsigned long negative_latency_samples;
+unsigned long undelivered_load_messages;
+std::mutex mt_latency;
+
+int latency_bucket(long long value) {
+    const int sub_buckets = 1 << LOAD_SUB_BUCKETS_BITS;
+    if (value < sub_buckets)
+        return (int) value;
+
+    int exponent = 63 - __builtin_clzll((unsigned long long) value);
+    int sub = (value >> (exponent - LOAD_SUB_BUCKETS_BITS)) & (sub_buckets - 1);
+    return (exponent - LOAD_SUB_BUCKETS_BITS + 1) * sub_buckets + sub;
+}
+
+long long latency_bucket_value(int bucket) {
+    const int sub_buckets = 1 << LOAD_SUB_BUCKETS_BITS;
+    if (bucket < sub_buckets)
+        return bucket;
+
+    int exponent = bucket / sub_buckets + LOAD_SUB_BUCKETS_BITS - 1;
+    int sub = bucket % sub_buckets;
+    return (long long) (sub_buckets + sub) << (exponent - LOAD_SUB_BUCKETS_BITS);
+}
+
+long long latency_percentile(double percentile) {
+    unsigned long threshold = (unsigned long) (percentile / 100.0 * latency_samples);
+    unsigned long count = 0;
+
+    for (int i = 0; i < LOAD_HISTOGRAM_SIZE; i++) {
+        count += latency_histogram[i];
+        // highest value in the bucket, so that percentiles are never understated
+        if (count > threshold) {
+            long long value = latency_bucket_value(i + 1) - 1;
+            return (value < latency_max) ? value : latency_max;
+        }
+    }
+    return latency_max;
+}
+
+/**
+ * Parses fixed width header of load message payload (see make_load_message).
+ * Returns -1 if the payload is not a load message, e.g. chat text that only starts with the prefix.
+ */
+int parse_load_header(const char* payload, unsigned long* seq, long long* send_time_us) {
+    const int prefix_len = strlen(LOAD_MSG_PREFIX);
+    const int seq_index = prefix_len + 1;
+    const int time_index = seq_index + 11;
+
+    if (strnlen(payload, LOAD_HEADER_SIZE) < LOAD_HEADER_SIZE || strncmp(payload, LOAD_MSG_PREFIX, prefix_len) != 0)
+        return -1;
+
+    for (int i = prefix_len; i < LOAD_HEADER_SIZE; i++) {
+        bool separator = (i == prefix_len || i == time_index - 1 || i == LOAD_HEADER_SIZE - 1);
+        if (separator ? (payload[i] != ' ') : (payload[i] < '0' || payload[i] > '9'))
+            return -1;
+    }
+
+    *seq = strtoul(&payload[seq_index], NULL, 10);
+    *send_time_us = strtoll(&payload[time_index], NULL, 10);
+    return 0;
+}
+
+bool is_load_message(const char* payload) {
+    unsigned long seq;
+    long long send_time_us;
+    return parse_load_header(payload, &seq, &send_time_us) == 0;
+}
+
+/**
+ * Records one-way latency of load message with given payload. Negative latencies come from
+ * clock skew between hosts; they are counted separately instead of being put into the histogram.
+ */
+void record_load_latency(const char* payload) {
+    unsigned long seq;
+    long long send_time_us;
+    if (parse_load_header(payload, &seq, &send_time_us) < 0)
+        return;
+
+    long long latency = current_time_us() - send_time_us;
+
+    std::lock_guard<std::mutex> lock(mt_latency);
+    if (latency < 0) {
+        negative_latency_samples++;
+        return;
+    }
+
+    latency_histogram[latency_bucket(latency)]++;
+    latency_samples++;
+    if (latency > latency_max)
+        latency_max = latency;
+}
+
+// counts load message sent by this process that came back because the receiver was not found
+void record_undelivered_load_message() {
+    std::lock_guard<std::mutex> lock(mt_latency);
+    undelivered_load_messages++;
+}
+
+/**
+ * Prints the latency distribution collected so far and, in load mode, the generator state.
+ * Periodic reports are skipped when nothing has changed since the previous one, final report
+ * is printed whenever there is any data.
+ */
+void print_load_report(bool final) {
+    static unsigned long reported_samples = 0;
+    static unsigned long reported_negative = 0;
+    static unsigned long reported_undelivered = 0;
+    static unsigned long reported_generated = 0;
+
+    std::lock_guard<std::mutex> lock(mt_latency);
+    unsigned long generated = load_generated.load();
+
+    if (latency_samples == 0 && negative_latency_samples == 0 && undelivered_load_messages == 0 && generated == 0)
+        return;
+
+    if (!final && latency_samples == reported_samples && negative_latency_samples == reported_negative &&
+            undelivered_load_messages == reported_undelivered && generated == reported_generated)
+        return;
+
+    if (latency_samples > 0 || negative_latency_samples > 0)
+        printf("latency [us] samples: %lu, p50: %lld, p90: %lld, p99: %lld, p99.9: %lld, max: %lld, "
+            "negative (clock skew): %lu\n",
+            latency_samples, latency_percentile(50), latency_percentile(90), latency_percentile(99),
+            latency_percentile(99.9), latency_max, negative_latency_samples);
+
+    if (load_mode)
+        printf("load generated: %lu, dropped (queue full): %lu, undelivered: %lu, queue depth: %d\n",
+            generated, load_dropped.load(), undelivered_load_messages,
+            message_queue_depth.load(std::memory_order_relaxed));
+    fflush(stdout);
+
+    reported_samples = latency_samples;
+    reported_negative = negative_latency_samples;
+    reported_undelivered = undelivered_load_messages;
+    reported_generated = generated;
+}
+
+
+
 // ==========================================================================================
 // Thread methods implementation
 // ==========================================================================================
@@ -208,9 +446,64 @@ void user_input_thread() {
     }
 }
 
+/**
+ * Open-loop traffic source used instead of user input in load mode. Messages are enqueued
+ * at their scheduled times regardless of how fast the ring delivers them, and each message
+ * carries its intended (not actual) send time, so queueing delay shows up in the latency.
+ */
+void load_generator_thread() {
+
+    std::mt19937_64 rng(std::random_device{}());
+    std::exponential_distribution<double> poisson_gap(load_rate);
+    std::uniform_int_distribution<int> uniform_size(load_min_size, load_max_size);
+    std::exponential_distribution<double> exponential_size(4.0 / (load_max_size - load_min_size + 1));
+    std::uniform_int_distribution<size_t> destination(0, load_destinations.size() - 1);
+
+    // schedule is kept on monotonic clock, send times are converted to wall clock
+    // so that they can be compared by other nodes
+    auto start = std::chrono::steady_clock::now();
+    long long start_time_us = current_time_us();
+    auto next_send = start;
+    unsigned long seq = 0;
+
+    while (true) {
+        std::this_thread::sleep_until(next_send);
+
+        long long send_time_us = start_time_us +
+            std::chrono::duration_cast<std::chrono::microseconds>(next_send - start).count();
+
+        int size = load_min_size;
+        if (load_size_distribution == LOAD_SIZE_UNIFORM)
+            size = uniform_size(rng);
+
+        // exponential tail above min_size with mean at a quarter of the range, redrawn above max_size
+        else if (load_size_distribution == LOAD_SIZE_EXPONENTIAL && load_max_size > load_min_size) {
+            double extra;
+            while ((extra = exponential_size(rng)) > load_max_size - load_min_size);
+            size = load_min_size + (int) extra;
+        }
+
+        // sizes and destinations are validated on startup, so the message always fits
+        struct data_message msg;
+        const char* receiver = load_destinations[destination(rng)].c_str();
+        make_load_message(receiver, seq++, send_time_us, size, &msg);
+        load_generated++;
+
+        // an overloaded ring would otherwise make the queue grow without limit
+        if (message_queue_depth.load(std::memory_order_relaxed) >= LOAD_MAX_QUEUE_DEPTH)
+            load_dropped++;
+        else
+            push_data_message(msg);
+
+        double gap = load_poisson ? poisson_gap(rng) : 1.0 / load_rate;
+        next_send += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(gap));
+    }
+}
+
 void token_process_thread(Transmission* ts) {
 
-    usleep(TOKEN_SLEEP_TIME);
+    usleep(token_hold_time);
 
     if (token_is_free) {
 
@@ -250,6 +543,7 @@ void token_process_thread(Transmission* ts) {
     }
 
     struct sockaddr_in dest = get_neighbour_address();
+    trace_frame(TRACE_SENT, forward_buffer, forward_data_size, &dest);
     ts->send_bytes(forward_buffer, forward_data_size, &dest);
 }
 
@@ -259,6 +553,7 @@ void receive_thread(Transmission* ts) {
 
     while (true) {
         int msg_size = ts->receive_bytes(buffer, MAX_MSG_SIZE, &sender_address);
+        trace_frame(TRACE_RECEIVED, buffer, msg_size, &sender_address);
         format_log_message(buffer, msg_size);
         ts->log(log_message, log_data_size);
         char type = buffer[0];
@@ -276,8 +571,12 @@ void receive_thread(Transmission* ts) {
 
                 // if the message is addressed to this process
                 if (strcmp(&msg.buffer[msg.receiver_index], username) == 0) {
-                    std::cout << "message from " << &msg.buffer[msg.sender_index] << ": "
-                        << &msg.buffer[msg.data_index] << std::endl;
+                    if (is_load_message(&msg.buffer[msg.data_index]))
+                        record_load_latency(&msg.buffer[msg.data_index]);
+
+                    else
+                        std::cout << "message from " << &msg.buffer[msg.sender_index] << ": "
+                            << &msg.buffer[msg.data_index] << std::endl;
 
                     // frees the token since the data has beed successfully delivered
                     token_is_free = true;
@@ -285,8 +584,12 @@ void receive_thread(Transmission* ts) {
                 
                 // if the message was sent by this process
                 else if (strcmp(&msg.buffer[msg.sender_index], username) == 0) {
-                    std::cout << "message to " << &msg.buffer[msg.receiver_index] << ": \""
-                        << &msg.buffer[msg.data_index] << "\" was not delivered" <<  std::endl;
+                    if (is_load_message(&msg.buffer[msg.data_index]))
+                        record_undelivered_load_message();
+
+                    else
+                        std::cout << "message to " << &msg.buffer[msg.receiver_index] << ": \""
+                            << &msg.buffer[msg.data_index] << "\" was not delivered" <<  std::endl;
 
                     // frees the token since the receiver was not found in the network
                     token_is_free = true; 
@@ -350,7 +653,10 @@ void receive_thread(Transmission* ts) {
 int main(int argc, char const *argv[]) {
     
     if (argc < 7) {
-        std::cout << "usage: ./main login self_ip self_port next_ip next_port ( tcp | udp ) [token]" << std::endl;
+        std::cout << "usage: ./main login self_ip self_port next_ip next_port ( tcp | udp ) [token]"
+            << " [--load dest1,dest2,... rate ( fixed | poisson ) ( fixed | uniform | exponential ) min_size max_size]"
+            << " [--hold microseconds] [--trace trace_file]" << std::endl
+            << "load payload sizes include " << LOAD_HEADER_SIZE << " bytes of header" << std::endl;
         exit(0);
     }
 
@@ -367,7 +673,85 @@ int main(int argc, char const *argv[]) {
     transport_protocol = (strcmp(argv[6], "tcp") == 0) ? TRANSPORT_TCP : TRANSPORT_UDP;
     Transmission ts(self_ip, self_port, transport_protocol);
 
-    has_starting_token = (argc > 7) ? true : false;
+    int arg_index = 7;
+    has_starting_token = (argc > arg_index && strncmp(argv[arg_index], "--", 2) != 0) ? true : false;
+    if (has_starting_token)
+        arg_index++;
+
+    while (argc > arg_index) {
+
+        if (strcmp(argv[arg_index], "--load") == 0) {
+            if (argc < arg_index + 7) {
+                std::cout << "load mode: --load dest1,dest2,... rate ( fixed | poisson )"
+                    << " ( fixed | uniform | exponential ) min_size max_size" << std::endl;
+                exit(0);
+            }
+
+            std::string destinations = argv[arg_index + 1];
+            for (size_t begin = 0, end; begin <= destinations.size(); begin = end + 1) {
+                end = destinations.find(',', begin);
+                if (end == std::string::npos)
+                    end = destinations.size();
+                if (end > begin)
+                    load_destinations.push_back(destinations.substr(begin, end - begin));
+            }
+
+            load_rate = atof(argv[arg_index + 2]);
+            load_poisson = (strcmp(argv[arg_index + 3], "poisson") == 0) ? true : false;
+
+            const char* distribution = argv[arg_index + 4];
+            load_size_distribution = (strcmp(distribution, "fixed") == 0) ? LOAD_SIZE_FIXED :
+                (strcmp(distribution, "uniform") == 0) ? LOAD_SIZE_UNIFORM :
+                (strcmp(distribution, "exponential") == 0) ? LOAD_SIZE_EXPONENTIAL : 0;
+
+            load_min_size = atoi(argv[arg_index + 5]);
+            load_max_size = atoi(argv[arg_index + 6]);
+
+            if (load_destinations.empty() || load_rate <= 0 || load_size_distribution == 0 ||
+                    load_max_size < load_min_size ||
+                    (load_size_distribution == LOAD_SIZE_FIXED && load_max_size != load_min_size)) {
+                std::cout << "invalid load parameters" << std::endl;
+                exit(0);
+            }
+
+            if (load_min_size < LOAD_HEADER_SIZE) {
+                std::cout << "invalid load parameters: payload size must be at least "
+                    << LOAD_HEADER_SIZE << " bytes (header included)" << std::endl;
+                exit(0);
+            }
+
+            for (size_t i = 0; i < load_destinations.size(); i++) {
+                int max_size = max_load_payload_size(load_destinations[i].c_str());
+                if (load_max_size > max_size) {
+                    std::cout << "invalid load parameters: payload to " << load_destinations[i]
+                        << " can have at most " << max_size << " bytes (header included)" << std::endl;
+                    exit(0);
+                }
+            }
+
+            load_mode = true;
+            arg_index += 7;
+        }
+
+        else if (strcmp(argv[arg_index], "--hold") == 0 && argc > arg_index + 1) {
+            token_hold_time = atoi(argv[arg_index + 1]);
+            if (token_hold_time < 0) {
+                std::cout << "invalid hold time" << std::endl;
+                exit(0);
+            }
+            arg_index += 2;
+        }
+
+        else if (strcmp(argv[arg_index], "--trace") == 0 && argc > arg_index + 1) {
+            trace = new Trace(argv[arg_index + 1], username, &self_address);
+            arg_index += 2;
+        }
+
+        else {
+            std::cout << "unknown option: " << argv[arg_index] << std::endl;
+            exit(0);
+        }
+    }
 
     if(next_port > 0) {
 
@@ -388,6 +772,7 @@ int main(int argc, char const *argv[]) {
         char buffer[MAX_MSG_SIZE];
         int size = serialize_connection_msg(&msg, buffer);
 
+        trace_frame(TRACE_SENT, buffer, size, &neighbour_address);
         ts.send_bytes(buffer, size, &neighbour_address);
         connection_established = true;
     }
@@ -397,9 +782,28 @@ int main(int argc, char const *argv[]) {
     }
     
     
+    // termination signals are blocked before starting the threads (which inherit the mask),
+    // so only the main thread receives them and can safely print the final load report
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
     std::thread receiver(&receive_thread, &ts);
-    std::thread input(&user_input_thread);
+    std::thread input = load_mode ? std::thread(&load_generator_thread) : std::thread(&user_input_thread);
+    receiver.detach();
+    input.detach();
+
+    struct timespec report_period;
+    report_period.tv_sec = LOAD_REPORT_PERIOD;
+    report_period.tv_nsec = 0;
+
+    while (sigtimedwait(&signals, NULL, &report_period) < 0)
+        print_load_report(false);
 
-    receiver.join();
-    input.join();
+    // other threads are still running, so global objects must not be destroyed
+    print_load_report(true);
+    fflush(stdout);
+    _exit(0);
 }
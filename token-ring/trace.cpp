@@ -0,0 +1,93 @@
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "chat_protocol.h"
+#include "trace.h"
+
+
+uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+// ==========================================================================================
+// Trace class implementation
+// ==========================================================================================
+
+/**
+ * Creates (or truncates) trace file at given path, allocates disk blocks for TRACE_CAPACITY
+ * records and maps it into memory with all pages faulted in, so that recording a frame never
+ * touches the file system (and running out of disk space is reported here, not as SIGBUS).
+ */
+Trace::Trace(const char* path, const char* username, const struct sockaddr_in* self_address) {
+    size_t file_size = TRACE_HEADER_SIZE + (size_t) TRACE_CAPACITY * sizeof(trace_record);
+
+    if ((_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+        error_exit("ERROR when opening trace file");
+
+    // unlike posix functions, posix_fallocate returns the error code instead of setting errno
+    if ((errno = posix_fallocate(_fd, 0, file_size)) != 0)
+        error_exit("ERROR when allocating trace file");
+
+    void* mapping = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, 0);
+    if (mapping == MAP_FAILED)
+        error_exit("ERROR when mapping trace file");
+
+    _header = (struct trace_header*) mapping;
+    _records = (struct trace_record*) ((char*) mapping + TRACE_HEADER_SIZE);
+
+    memcpy(_header->magic, TRACE_MAGIC, sizeof(_header->magic));
+    _header->version = TRACE_VERSION;
+    _header->record_size = sizeof(trace_record);
+    _header->capacity = TRACE_CAPACITY;
+    _header->write_index = 0;
+    _header->base_realtime_ns = clock_ns(CLOCK_REALTIME);
+    _header->base_monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+    _header->self_ip = self_address->sin_addr.s_addr;
+    _header->self_port = self_address->sin_port;
+    strncpy(_header->username, username, sizeof(_header->username) - 1);
+}
+
+
+Trace::~Trace() {
+    munmap(_header, TRACE_HEADER_SIZE + (size_t) TRACE_CAPACITY * sizeof(trace_record));
+    close(_fd);
+}
+
+
+/**
+ * Appends one frame record. Slots are claimed with atomic increment, so the receive thread
+ * and token processing threads may record concurrently; the record becomes valid when its
+ * sequence number is stored. Data reaches the file through the page cache, no syscall is made.
+ */
+void Trace::record(char direction, const char* frame, int size, const struct sockaddr_in* peer, int queue_depth) {
+    uint64_t index = __atomic_fetch_add(&_header->write_index, 1, __ATOMIC_RELAXED);
+    struct trace_record* rec = &_records[index & (TRACE_CAPACITY - 1)];
+
+    __atomic_store_n(&rec->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    rec->timestamp_ns = clock_ns(CLOCK_MONOTONIC);
+    rec->frame_type = frame[0];
+    rec->direction = direction;
+
+    if (frame[0] == MSG_DATA)
+        rec->token_state = (frame[1] == 1) ? TRACE_TOKEN_FREE : TRACE_TOKEN_BUSY;
+    else
+        rec->token_state = (frame[1] == 1) ? TRACE_TOKEN_BUSY : TRACE_TOKEN_NONE;
+
+    rec->reserved = 0;
+    rec->size = size;
+    rec->queue_depth = (queue_depth > 0xffff) ? 0xffff : queue_depth;
+    rec->peer_ip = peer->sin_addr.s_addr;
+    rec->peer_port = peer->sin_port;
+    rec->reserved2 = 0;
+
+    __atomic_store_n(&rec->sequence, index + 1, __ATOMIC_RELEASE);
+}
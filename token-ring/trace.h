@@ -0,0 +1,64 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// trace file settings
+#define TRACE_MAGIC         "TRTRACE1"
+#define TRACE_VERSION       1
+#define TRACE_HEADER_SIZE   4096        // header occupies first page, records start right after it
+#define TRACE_CAPACITY      (1 << 20)   // number of records (power of 2), oldest ones are overwritten
+
+// frame direction
+#define TRACE_RECEIVED  1
+#define TRACE_SENT      2
+
+// token state carried by the frame
+#define TRACE_TOKEN_NONE    0   // no token (connection request)
+#define TRACE_TOKEN_FREE    1   // free token
+#define TRACE_TOKEN_BUSY    2   // token carrying data or forwarded connection
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    uint64_t write_index;           // total number of records written so far
+    uint64_t base_realtime_ns;      // wall clock and monotonic clock sampled at the same moment,
+    uint64_t base_monotonic_ns;     // used to align traces of different hosts
+    uint32_t self_ip;               // network byte order
+    uint16_t self_port;             // network byte order
+    uint16_t reserved;
+    char username[32];
+};
+
+struct trace_record {
+    uint64_t timestamp_ns;          // monotonic clock
+    uint8_t frame_type;
+    uint8_t direction;
+    uint8_t token_state;
+    uint8_t reserved;
+    uint16_t size;
+    uint16_t queue_depth;
+    uint32_t peer_ip;               // network byte order
+    uint16_t peer_port;             // network byte order
+    uint16_t reserved2;
+    uint64_t sequence;              // write index + 1, set last so that torn records can be skipped
+};
+
+// appends binary frame records to memory-mapped, preallocated ring of records
+class Trace {
+
+    int _fd;
+    struct trace_header* _header;
+    struct trace_record* _records;
+
+    public:
+        Trace(const char* path, const char* username, const struct sockaddr_in* self_address);
+        ~Trace();
+
+        void record(char direction, const char* frame, int size, const struct sockaddr_in* peer, int queue_depth);
+};
+
+#endif
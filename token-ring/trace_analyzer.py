@@ -0,0 +1,275 @@
+import mmap
+import socket
+import struct
+import sys
+
+# layout must match trace.h
+TRACE_MAGIC = b"TRTRACE1"
+TRACE_HEADER_SIZE = 4096
+HEADER_FORMAT = "<8sIIQQQQ4s2sH32s"
+RECORD_FORMAT = "<QBBBBHH4s2sHQ"
+
+TRACE_RECEIVED = 1
+TRACE_SENT = 2
+
+TRACE_TOKEN_NONE = 0
+
+FRAME_TYPES = {1: "DATA", 2: "CONREQ", 3: "CONFWD"}
+
+
+def address(ip, port):
+    return "%s:%d" % (socket.inet_ntoa(ip), struct.unpack(">H", port)[0])
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+
+def stats(values_ns):
+    """Formats count and distribution of given durations in microseconds."""
+    if not values_ns:
+        return "count: 0"
+    us = [v / 1000.0 for v in values_ns]
+    return "count: %d, mean: %.1f, p50: %.1f, p99: %.1f, max: %.1f" % (
+        len(us), sum(us) / len(us), percentile(us, 50), percentile(us, 99), max(us))
+
+
+class Node:
+    """Reads one node's trace file and converts its records to wall clock time."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+        (magic, version, record_size, capacity, write_index, base_realtime, base_monotonic,
+            self_ip, self_port, _, username) = struct.unpack_from(HEADER_FORMAT, data, 0)
+
+        if magic != TRACE_MAGIC or record_size != struct.calcsize(RECORD_FORMAT):
+            raise ValueError("%s is not a trace file" % path)
+
+        self.name = username.split(b"\0")[0].decode("utf-8")
+        self.address = address(self_ip, self_port)
+        self.records = []
+        self.lost = max(0, write_index - capacity)
+
+        for slot in range(min(write_index, capacity)):
+            (timestamp, frame_type, direction, token_state, _, size, queue_depth,
+                peer_ip, peer_port, _, sequence) = struct.unpack_from(
+                    RECORD_FORMAT, data, TRACE_HEADER_SIZE + slot * record_size)
+
+            # skips slots that were being written when the node stopped
+            if sequence == 0 or (sequence - 1) % capacity != slot:
+                continue
+
+            self.records.append({
+                "sequence": sequence,
+                "time": base_realtime + (timestamp - base_monotonic),
+                "type": FRAME_TYPES.get(frame_type, str(frame_type)),
+                "direction": direction,
+                "token": token_state,
+                "size": size,
+                "queue": queue_depth,
+                "peer": address(peer_ip, peer_port),
+                "node": self,
+            })
+
+        data.close()
+        self.records.sort(key=lambda r: r["sequence"])
+        self.token_received = [r for r in self.records
+            if r["direction"] == TRACE_RECEIVED and r["token"] != TRACE_TOKEN_NONE]
+        self.token_sent = [r for r in self.records
+            if r["direction"] == TRACE_SENT and r["token"] != TRACE_TOKEN_NONE]
+
+        # the token leaves the node with the first token frame sent after it was received
+        received = None
+        for r in self.records:
+            if r["token"] == TRACE_TOKEN_NONE:
+                continue
+            if r["direction"] == TRACE_RECEIVED:
+                received = r
+            elif received is not None:
+                received["next_send"] = r
+                r["previous_receive"] = received
+                received = None
+
+    def ip(self):
+        return self.address.split(":")[0]
+
+
+def sender_of(received, by_address, senders):
+    """Returns the node that sent given frame. UDP frames come from the sender's own address,
+    TCP ones from an ephemeral port, so those are attributed by IP when it is unambiguous."""
+    node = by_address.get(received["peer"])
+    if node is not None:
+        return node
+
+    candidates = [n for n in senders if n.ip() == received["peer"].split(":")[0]]
+    return candidates[0] if len(candidates) == 1 else None
+
+
+def align_from_end(sent, received):
+    """Pairs frames of a link whose beginning was overwritten. The last sent frame may still have
+    been in flight when the receiver stopped; pairing it anyway would shift every hop by a round,
+    so the alignment with smaller median latency is chosen (valid while skew is below half a round)."""
+    candidates = []
+    for in_flight in (0, 1):
+        s = sent[:len(sent) - in_flight]
+        count = min(len(s), len(received))
+        if count == 0:
+            continue
+        pairs = list(zip(s[len(s) - count:], received[len(received) - count:]))
+        candidates.append((abs(percentile([r["time"] - x["time"] for x, r in pairs], 50)), pairs))
+
+    return min(candidates, key=lambda c: c[0])[1] if candidates else []
+
+
+def match_hops(nodes):
+    """Pairs sent token frames with the frames received by their destinations.
+
+    Frames on each link (A -> B) are paired by order: k-th token frame sent by A to B with k-th
+    token frame received by B from A. Clocks of different hosts are not compared, so skew only
+    affects the reported latency. If either trace was overwritten, lists are aligned at the end.
+    Returns the number of frames left without a pair.
+    """
+    by_address = {node.address: node for node in nodes}
+    unmatched = 0
+
+    for dest in nodes:
+        sent_to_dest = {}
+        for node in nodes:
+            frames = [r for r in node.token_sent if r["peer"] == dest.address]
+            if frames:
+                sent_to_dest[node] = frames
+
+        received_from = {}
+        for r in dest.token_received:
+            sender = sender_of(r, by_address, sent_to_dest.keys())
+            if sender is None:
+                unmatched += 1
+            else:
+                received_from.setdefault(sender, []).append(r)
+
+        for node, sent in sent_to_dest.items():
+            received = received_from.get(node, [])
+            pairs = align_from_end(sent, received) if node.lost or dest.lost else list(zip(sent, received))
+
+            for s, r in pairs:
+                s["received"] = r
+                r["sent"] = s
+            unmatched += len(sent) + len(received) - 2 * len(pairs)
+
+        for node, received in received_from.items():
+            if node not in sent_to_dest:
+                unmatched += len(received)
+
+    return unmatched
+
+
+def rebuild_path(nodes):
+    """Follows the token back from its latest reception: receive <- send <- receive on the
+    previous node... until a frame without a pair, so the path is the longest recent stretch
+    that is not interrupted by overwritten or missing records."""
+    received = [r for node in nodes for r in node.token_received]
+    if not received:
+        return []
+
+    path = []
+    current = max(received, key=lambda r: r["time"])
+    while current is not None:
+        path.append(current)
+        sent = current.get("sent")
+        current = sent.get("previous_receive") if sent is not None else None
+    return path[::-1]
+
+
+def report(nodes):
+    unmatched = match_hops(nodes)
+    path = rebuild_path(nodes)
+
+    print("nodes:")
+    for node in nodes:
+        queue = [r["queue"] for r in node.records] or [0]
+        print("  %s (%s): %d frames, %d overwritten, queue depth mean: %.1f, max: %d" % (
+            node.name, node.address, len(node.records), node.lost,
+            sum(queue) / float(len(queue)), max(queue)))
+
+    if not path:
+        print("no token frames found")
+        return
+
+    # statistics use every matched pair, the path is only used for rounds
+    hold = {}
+    wire = {}
+    skewed = {}
+    for node in nodes:
+        for received in node.token_received:
+            sent = received.get("next_send")
+            if sent is None:
+                continue
+            hold.setdefault(node.name, []).append(sent["time"] - received["time"])
+
+        for sent in node.token_sent:
+            if "received" not in sent:
+                continue
+            link = "%s -> %s" % (node.name, sent["received"]["node"].name)
+            latency = sent["received"]["time"] - sent["time"]
+            wire.setdefault(link, []).append(latency)
+            if latency < 0:
+                skewed[link] = skewed.get(link, 0) + 1
+
+    # a round ends whenever the token returns to the node where the path ends
+    start = path[-1]["node"]
+    returns = [i for i, r in enumerate(path) if r["node"] is start]
+    rounds = [path[i]["time"] for i in returns]
+    round_times = [b - a for a, b in zip(rounds, rounds[1:])]
+    last_round = path[returns[-2]:returns[-1] + 1] if len(returns) > 1 else path
+
+    print("token path (last round): %s" % " -> ".join(r["node"].name for r in last_round))
+    print("rounds [us]: %s" % stats(round_times))
+    print("unmatched token frames: %d" % unmatched)
+
+    # time between receptions minus time held is spent in transit; this uses differences
+    # measured on a single clock only, so unlike per-hop latency it is immune to skew
+    if round_times:
+        stretch = path[returns[0]:returns[-1]]
+        held = sum(r["next_send"]["time"] - r["time"] for r in stretch)
+        transit = (path[returns[-1]]["time"] - path[returns[0]]["time"] - held) / float(len(round_times))
+        print("in transit per round [us]: %.1f (not affected by clock skew)" % (transit / 1000.0))
+
+    print("hold time per node [us]:")
+    for name, values in sorted(hold.items()):
+        print("  %s: %s" % (name, stats(values)))
+
+    # a hop cannot take longer than the whole round, so such values mean the clocks disagree
+    longest_round = max(round_times) if round_times else None
+    for link, values in wire.items():
+        too_long = len([v for v in values if longest_round is not None and v > longest_round])
+        if too_long:
+            skewed[link] = skewed.get(link, 0) + too_long
+
+    print("per-hop latency [us]:")
+    for link, values in sorted(wire.items()):
+        print("  %s: %s" % (link, stats(values)))
+        if skewed.get(link):
+            print("    clock skew between nodes: %d hops negative or longer than a round, median: %.1f" % (
+                skewed[link], percentile(values, 50) / 1000.0))
+
+    shares = [("holding at " + name, sum(v)) for name, v in hold.items()]
+    shares += [("in transit " + link, sum(v)) for link, v in wire.items() if link not in skewed]
+    total = float(sum(value for _, value in shares)) or 1.0
+
+    print("time spent by the token:")
+    for what, value in sorted(shares, key=lambda s: -s[1]):
+        print("  %5.1f%%  %s" % (100.0 * value / total, what))
+
+    if skewed:
+        print("  (links with clock skew are left out)")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        print("usage: python3 trace_analyzer.py node1.trace node2.trace ...")
+        sys.exit(0)
+
+    report([Node(path) for path in sys.argv[1:]])